@@ -18,13 +18,28 @@
  * 3. This notice may not be removed or altered from any source distribution.
  *
  *
- * $Date:        10. December 2021
- * $Revision:    V1.2.0
+ * $Date:        18. October 2026
+ * $Revision:    V1.3.0
  *
  * Project:      Flash Programming Functions for ST STM32G0xx Flash
  * --------------------------------------------------------------------------- */
 
 /* History:
+ *  Version 1.3.0
+ *    Added optional flash page statistics (FLASH_STATS)
+ *    Added optional skip of Double Words containing only the erased value (FLASH_SKIP_ERASED)
+ *    Added EraseBank function
+ *    Failed operations report address and error flags (flashErrAdr, flashErrSR)
+ *    Added optional deferred page erase (FLASH_ERASE_DEFERRED)
+ *    Added EraseProgram function
+ *    Register offsets checked at compile time, erase started with a single CR write
+ *    Added optional read back of each Double Word in ProgramPage (FLASH_PROG_VERIFY)
+ *    Added optional CRC of programmed data reported at UnInit (FLASH_CRC)
+ *    Added ProgramScatter function
+ *    Added optional session mode: unlock only if locked, host requested relock deferral (FLASH_SESSION)
+ *    Added algorithm header and Resident function
+ *    Added optional device ID and page hashes reported by Init (FLASH_HASH)
+ *    OTP ProgramPage skips written Double Words and rejects conflicts before programming
  *  Version 1.2.0
  *    Added DualBank support & Rework
  *  Version 1.1.0
@@ -51,6 +66,7 @@
   512kB devices are always handled as ‘Dual Bank’ even if they are configured as ‘Single Bank’.
  */
 
+#include <stddef.h>
 #include "..\FlashOS.h"        /* FlashOS Structures */
 
 typedef volatile unsigned long    vu32;
@@ -64,6 +80,7 @@ typedef          unsigned long     u32;
 #define FLASH_BASE        (0x40022000U)
 #define DBGMCU_BASE       (0x40015800U)
 #define FLASHSIZE_BASE    (0x1FFF75E0U)
+#define UID_BASE          (0x1FFF7590U)
 
 #define WWDG            ((WWDG_TypeDef   *) WWDG_BASE)
 #define IWDG            ((IWDG_TypeDef   *) IWDG_BASE)
@@ -121,6 +138,41 @@ typedef struct {
 } WWDG_TypeDef;
 
 
+/* Compile time check of register offsets (transcribed by hand from CMSIS/SVD/STM32G0B1.svd) */
+#define REG_CHECK(type, reg, ofs) \
+  typedef char chk_##type##_##reg[(offsetof(type, reg) == (ofs)) ? 1 : -1]
+
+REG_CHECK(DBGMCU_TypeDef, IDCODE,    0x00);
+REG_CHECK(IWDG_TypeDef,   KR,        0x00);
+REG_CHECK(IWDG_TypeDef,   PR,        0x04);
+REG_CHECK(IWDG_TypeDef,   RLR,       0x08);
+REG_CHECK(IWDG_TypeDef,   SR,        0x0C);
+REG_CHECK(IWDG_TypeDef,   WINR,      0x10);
+REG_CHECK(WWDG_TypeDef,   CR,        0x00);
+REG_CHECK(WWDG_TypeDef,   CFR,       0x04);
+REG_CHECK(WWDG_TypeDef,   SR,        0x08);
+REG_CHECK(FLASH_TypeDef,  ACR,       0x00);
+REG_CHECK(FLASH_TypeDef,  KEYR,      0x08);
+REG_CHECK(FLASH_TypeDef,  OPTKEYR,   0x0C);
+REG_CHECK(FLASH_TypeDef,  SR,        0x10);
+REG_CHECK(FLASH_TypeDef,  CR,        0x14);
+REG_CHECK(FLASH_TypeDef,  ECCR,      0x18);
+REG_CHECK(FLASH_TypeDef,  OPTR,      0x20);
+REG_CHECK(FLASH_TypeDef,  PCROP1ASR, 0x24);
+REG_CHECK(FLASH_TypeDef,  PCROP1AER, 0x28);
+REG_CHECK(FLASH_TypeDef,  WRP1AR,    0x2C);
+REG_CHECK(FLASH_TypeDef,  WRP1BR,    0x30);
+REG_CHECK(FLASH_TypeDef,  PCROP1BSR, 0x34);
+REG_CHECK(FLASH_TypeDef,  PCROP1BER, 0x38);
+REG_CHECK(FLASH_TypeDef,  PCROP2ASR, 0x44);
+REG_CHECK(FLASH_TypeDef,  PCROP2AER, 0x48);
+REG_CHECK(FLASH_TypeDef,  WRP2AR,    0x4C);
+REG_CHECK(FLASH_TypeDef,  WRP2BR,    0x50);
+REG_CHECK(FLASH_TypeDef,  PCROP2BSR, 0x54);
+REG_CHECK(FLASH_TypeDef,  PCROP2BER, 0x58);
+REG_CHECK(FLASH_TypeDef,  SECR,      0x80);
+
+
 /* Flash Keys */
 #define FLASH_KEY1               0x45670123
 #define FLASH_KEY2               0xCDEF89AB
@@ -134,7 +186,10 @@ typedef struct {
 #define FLASH_CR_PG             ((u32)(   1U      ))
 #define FLASH_CR_PER            ((u32)(   1U <<  1))
 #define FLASH_CR_MER1           ((u32)(   1U <<  2))
-#define FLASH_CR_PNB_MSK        ((u32)(0x7FU <<  3))
+#define FLASH_CR_PNB_POS        (3U)
+#define FLASH_CR_PNB_MSK        ((u32)(0x3FFU << FLASH_CR_PNB_POS))
+#define FLASH_CR_BKER_POS       (13U)
+#define FLASH_CR_BKER           ((u32)(   1U << FLASH_CR_BKER_POS))
 #define FLASH_CR_MER2           ((u32)(   1U << 15))
 #define FLASH_CR_STRT           ((u32)(   1U << 16))
 #define FLASH_CR_OPTSTRT        ((u32)(   1U << 17))
@@ -156,6 +211,7 @@ typedef struct {
 #define FLASH_SR_OPTVERR        ((u32)(   1U << 15))
 #define FLASH_SR_BSY1           ((u32)(   1U << 16))
 #define FLASH_SR_BSY2           ((u32)(   1U << 17))
+#define FLASH_SR_CFGBSY         ((u32)(   1U << 18))
 
 #define FLASH_SR_BSY            (FLASH_SR_BSY1 | FLASH_SR_BSY2)
 #define FLASH_PGERR             (FLASH_SR_OPERR   | FLASH_SR_PROGERR | FLASH_SR_WRPERR | \
@@ -177,6 +233,136 @@ u32 flashSize;                   /* Flash size in bytes */
 u32 flashBankSize;               /* Flash bank size in bytes */
 u32 flashBankMode;               /* Flash bank mode, configured as single or dual bank */
 
+#if defined FLASH_MEM && defined FLASH_STATS
+/* Flash page statistics
+   The block 'flashStats' stays in RAM as long as the algorithm is not reloaded.
+   It is indexed by [bank number][page number] as returned by GetFlashBankNum()
+   and GetFlashPageNum() and can be read back by the host after a session.
+   Counters saturate at 0xFFFF.
+ */
+#define FLASH_STATS_ID          0x53544750U              /* 'PGTS' */
+#define FLASH_STATS_PAGES       128U                     /* max pages per bank */
+
+typedef struct {
+  unsigned short erase;          /* Number of page erases */
+  unsigned short prog;           /* Number of programmed Double Words */
+  unsigned short skip;           /* Number of skipped Double Words (FLASH_SKIP_ERASED) */
+  unsigned short reserved;
+} PAGE_STATS;
+
+struct {
+  u32 id;                        /* FLASH_STATS_ID if block is valid */
+  u32 init;                      /* Number of Init calls */
+  u32 pages;                     /* Pages per bank (FLASH_STATS_PAGES) */
+  PAGE_STATS page[2][FLASH_STATS_PAGES];
+} flashStats;
+#endif /* FLASH_MEM && FLASH_STATS */
+
+u32 flashErrAdr;                 /* Address of the last failed operation */
+u32 flashErrSR;                  /* Error flags (FLASH->SR) of the last failed operation */
+
+#if defined FLASH_MEM && defined FLASH_ERASE_DEFERRED
+/* Deferred Erase
+   EraseSector() returns as soon as the page erase is started. The next
+   algorithm call, Init() included, waits for its completion and reports
+   a deferred error with the address of the erased page (flashErrAdr).
+ */
+static u32 erasePending;         /* 1 = page erase started, result not yet checked */
+static u32 eraseAdr;             /* Address of the pending page erase */
+#endif /* FLASH_MEM && FLASH_ERASE_DEFERRED */
+
+#if (defined FLASH_MEM || defined FLASH_OTP) && defined FLASH_CRC
+/* Programmed Data CRC
+   Init(2) opens the block 'flashCrc' (id = 0). While it is open,
+   ProgramPage() folds the requested bytes, as read back from flash after
+   programming, into a CRC-32 (same as zlib crc32()) in programming order.
+   The padding to full Double Words is not part of the CRC or 'cnt'.
+   The next UnInit() finalizes the block and sets 'id' to FLASH_CRC_ID.
+   The host compares 'crc' with its own CRC over the same data instead of a
+   separate verify pass.
+ */
+#define FLASH_CRC_ID            0x43524331U              /* '1CRC' */
+
+struct {
+  u32 id;                        /* FLASH_CRC_ID if block is final */
+  u32 crc;                       /* CRC-32 of programmed data */
+  u32 cnt;                       /* Number of programmed bytes */
+  u32 start;                     /* Lowest programmed address */
+  u32 end;                       /* Highest programmed address + 1 */
+} flashCrc;
+
+static u32 crcOpen;              /* 1 = Init(2) opened flashCrc */
+#endif /* (FLASH_MEM || FLASH_OTP) && FLASH_CRC */
+
+#if defined FLASH_MEM && defined FLASH_HASH
+/* Flash Page Hashes
+   Init(1) stores the 96-bit unique device ID and the CRC-32 (zlib) of every
+   2K page in address order in 'flashHash'. A host which keeps the page
+   hashes of the last image written per device ID can select the changed
+   pages without reading back the flash.
+   Hashing costs about 2ms per page at the 16MHz reset clock, so Init(1)
+   takes about one second on a 512kB device. The host timeout for Init has
+   to allow for this; both watchdogs are reloaded per page.
+ */
+#define FLASH_HASH_ID           0x48534148U              /* 'HASH' */
+#define FLASH_HASH_PAGES        256U                     /* max pages (512kB) */
+
+struct {
+  u32 id;                        /* FLASH_HASH_ID if block is valid */
+  u32 uid[3];                    /* Unique device ID */
+  u32 pages;                     /* Number of hashed pages */
+  u32 hash[FLASH_HASH_PAGES];    /* CRC-32 per page */
+} flashHash;
+#endif /* FLASH_MEM && FLASH_HASH */
+
+/* Algorithm Header
+   Placed first in PrgCode (see Target.lin). Debuggers load a breakpoint
+   stub in front of PrgCode, so the header is not at the start of the
+   algorithm RAM: a host looks for it at its own PrgCode load address.
+   A host which finds 'id' and 'vers' there can call Resident() and compare
+   the returned CRC-32 with the CRC over PrgCode of the FLM file to decide
+   whether the algorithm must be downloaded again. The header does not hold
+   that CRC (it would have to be patched in after linking): the host must
+   compute it itself, CRC-32 (zlib) over the whole PrgCode section of the
+   FLM, header included.
+   The linker symbols are declared const so that, with RWPI, they are
+   addressed PC-relative like PrgCode and not relative to R9.
+ */
+#define FLASH_ALGO_ID           0x4F474C41U              /* 'ALGO' */
+#define FLASH_ALGO_VERS         0x00010300U              /* V1.3.0 */
+
+extern const unsigned char Image$$PrgCode$$Base[];
+extern const unsigned char Image$$PrgCode$$Limit[];
+
+__attribute__((section("FlashAlgoHeader"), used))
+const u32 flashAlgoHeader[4] = {
+  FLASH_ALGO_ID,                 /* Signature */
+  FLASH_ALGO_VERS,               /* Algorithm version */
+  FLASH_DRV_VERS,                /* FlashOS driver version */
+  0U                             /* Reserved (no PrgCode CRC, see above) */
+};
+
+static const u32 crcTab[16] = {  /* CRC-32 (zlib), 4 bit table */
+  0x00000000U, 0x1DB71064U, 0x3B6E20C8U, 0x26D930ACU,
+  0x76DC4190U, 0x6B6B51F4U, 0x4DB26158U, 0x5005713CU,
+  0xEDB88320U, 0xF00F9344U, 0xD6D6A3E8U, 0xCB61B38CU,
+  0x9B64C2B0U, 0x86D3D2D4U, 0xA00AE278U, 0xBDBDF21CU
+};
+
+#if defined FLASH_SESSION
+/* Session Mode
+   Init does not unlock an already unlocked controller and skips unlocking
+   for verify (fnc 3). UnInit locks (and launches option bytes) as usual,
+   unless the host wrote FLASH_SESSION_KEEP to 'flashSessionKeep' before
+   the call: then the controller stays unlocked for the next phase. UnInit
+   clears the flag, so it has to be written again before each UnInit that
+   shall not lock.
+ */
+#define FLASH_SESSION_KEEP      0x5045454BU              /* 'KEEP' */
+
+u32 flashSessionKeep;            /* Written by host: keep unlocked at next UnInit */
+#endif /* FLASH_SESSION */
+
 static void __NOP(void) {
     __asm("NOP");
 }
@@ -186,6 +372,45 @@ static void __DSB(void) {
 }
 
 
+/*
+ * Update CRC-32
+ *    Parameter:      crc:  CRC value (not finalized)
+ *                    p:    Data
+ *                    n:    Size (in bytes)
+ *    Return Value:   Updated CRC value
+ */
+
+static u32 Crc32 (u32 crc, const unsigned char *p, u32 n) {
+
+  while (n--) {
+    crc = (crc >> 4) ^ crcTab[(crc ^ (*p     )) & 0x0FU];
+    crc = (crc >> 4) ^ crcTab[(crc ^ (*p >> 4)) & 0x0FU];
+    p++;
+  }
+
+  return (crc);
+}
+
+
+/*
+ * Record Flash Error
+ *    Parameter:      adr:  Address of the failed operation
+ *    Return Value:   1 - Failed
+ *
+ *  flashErrAdr/flashErrSR are kept until the next Init so that a host can
+ *  read back why and where an operation failed.
+ */
+
+static int FlashError (u32 adr) {
+
+  flashErrAdr = adr;
+  flashErrSR  = FLASH->SR & FLASH_PGERR;
+  FLASH->SR   = FLASH_PGERR;                             /* Reset Error Flags */
+
+  return (1);                                            /* Failed */
+}
+
+
 /*
  * Get Flash Type
  *    Return Value:   0 = Single-Bank Flash
@@ -299,6 +524,62 @@ static u32 GetFlashPageNum (unsigned long adr) {
 #endif /* FLASH_MEM */
 
 
+/*
+ * Get Flash Page Statistics
+ *    Parameter:      adr:  Page Address
+ *    Return Value:   Pointer to statistics entry of the page
+ */
+
+#if defined FLASH_MEM && defined FLASH_STATS
+static PAGE_STATS *GetPageStats (u32 adr) {
+
+  return (&flashStats.page[GetFlashBankNum(adr)][GetFlashPageNum(adr) & (FLASH_STATS_PAGES - 1U)]);
+}
+
+static void StatsInc (unsigned short *cnt) {
+
+  if (*cnt != 0xFFFFU) {                                 /* Saturate */
+    (*cnt)++;
+  }
+}
+
+static void StatsErase (u32 adr, u32 sz) {
+
+  for (; sz != 0U; sz -= 0x800U, adr += 0x800U) {       /* 2K sector size */
+    StatsInc(&GetPageStats(adr)->erase);
+  }
+}
+#endif /* FLASH_MEM && FLASH_STATS */
+
+
+/*
+ * Complete pending Page Erase
+ *    Return Value:   0 - OK (or nothing pending),  1 - Failed
+ */
+
+#if defined FLASH_MEM && defined FLASH_ERASE_DEFERRED
+static int EraseComplete (void) {
+
+  if (erasePending == 0U) {
+    return (0);
+  }
+  erasePending = 0U;
+
+  while (FLASH->SR & FLASH_SR_BSY) __NOP();
+
+  if (FLASH->SR & FLASH_PGERR) {                         /* Check for Error */
+    return (FlashError(eraseAdr));                       /* Failed */
+  }
+
+#if defined FLASH_STATS
+  StatsInc(&GetPageStats(eraseAdr)->erase);
+#endif
+
+  return (0);                                            /* Done */
+}
+#endif /* FLASH_MEM && FLASH_ERASE_DEFERRED */
+
+
 /*
  *  Initialize Flash Programming Functions
  *    Parameter:      adr:  Device Base Address
@@ -308,9 +589,23 @@ static u32 GetFlashPageNum (unsigned long adr) {
  */
 
 int Init (unsigned long adr, unsigned long clk, unsigned long fnc) {
+  u32 optr;
 
   __disable_irq();                                       /* Disable all interrupts */
 
+#if defined FLASH_SESSION
+  if ((fnc != 3U) && ((FLASH->CR & FLASH_CR_LOCK) != 0U)) {
+    FLASH->KEYR = FLASH_KEY1;                            /* Unlock Flash operation */
+    FLASH->KEYR = FLASH_KEY2;
+  }
+
+#ifdef FLASH_OPT
+  if ((fnc != 3U) && ((FLASH->CR & FLASH_CR_OPTLOCK) != 0U)) {
+    FLASH->OPTKEYR  = FLASH_OPTKEY1;                     /* Unlock Option Bytes operation */
+    FLASH->OPTKEYR  = FLASH_OPTKEY2;
+  }
+#endif /* FLASH_OPT */
+#else
   FLASH->KEYR = FLASH_KEY1;                              /* Unlock Flash operation */
   FLASH->KEYR = FLASH_KEY2;
 
@@ -318,10 +613,30 @@ int Init (unsigned long adr, unsigned long clk, unsigned long fnc) {
   FLASH->OPTKEYR  = FLASH_OPTKEY1;                       /* Unlock Option Bytes operation */
   FLASH->OPTKEYR  = FLASH_OPTKEY2;
 #endif /* FLASH_OPT */
+#endif /* FLASH_SESSION */
 
   /* Wait until the flash is ready */
   while (FLASH->SR & FLASH_SR_BSY) __NOP();
 
+#if defined FLASH_MEM && defined FLASH_ERASE_DEFERRED
+  if (EraseComplete() != 0) {                            /* Page erase left pending without UnInit */
+    return (1);
+  }
+#endif
+
+  flashErrAdr = 0U;
+  flashErrSR  = 0U;
+#if (defined FLASH_MEM || defined FLASH_OTP) && defined FLASH_CRC
+  if (fnc == 2U) {                                       /* Start new CRC for programming */
+    flashCrc.id    = 0U;
+    flashCrc.crc   = 0xFFFFFFFFU;
+    flashCrc.cnt   = 0U;
+    flashCrc.start = 0xFFFFFFFFU;
+    flashCrc.end   = 0U;
+    crcOpen        = 1U;
+  }
+#endif
+
 //FLASH->ACR  = 0x00000000;                              /* Zero Wait State, no Cache, no Prefetch */
 
 #if defined FLASH_MEM
@@ -332,7 +647,21 @@ int Init (unsigned long adr, unsigned long clk, unsigned long fnc) {
 	flashBankMode = GetFlashBankMode();
 #endif /* FLASH_MEM */
 
-  if ((FLASH->OPTR & FLASH_OPTR_IDWG_SW) == 0U) {        /* Test if IWDG is running (IWDG in HW mode) */
+  optr = FLASH->OPTR;
+
+#if defined FLASH_MEM && defined FLASH_STATS
+  if (flashStats.id != FLASH_STATS_ID) {                 /* Statistics not yet valid */
+    u32 i, *p = (u32 *)&flashStats;
+    for (i = 0U; i < (sizeof(flashStats) / 4U); i++) {
+      p[i] = 0U;
+    }
+    flashStats.id    = FLASH_STATS_ID;
+    flashStats.pages = FLASH_STATS_PAGES;
+  }
+  flashStats.init++;
+#endif /* FLASH_MEM && FLASH_STATS */
+
+  if ((optr & FLASH_OPTR_IDWG_SW) == 0U) {               /* Test if IWDG is running (IWDG in HW mode) */
     /* Set IWDG time out to ~32.768 second */
     IWDG->KR  = 0xAAAA; 
     IWDG->KR  = 0x5555;                                  /* Enable write access to IWDG_PR and IWDG_RLR */
@@ -340,11 +669,35 @@ int Init (unsigned long adr, unsigned long clk, unsigned long fnc) {
     IWDG->RLR = 4095;                                    /* Set reload value to 4095 */
   }
 
-  if ((FLASH->OPTR & FLASH_OPTR_WWDG_SW) == 0U) {        /* Test if WWDG is running (WWDG_SW in HW mode) */
+  if ((optr & FLASH_OPTR_WWDG_SW) == 0U) {               /* Test if WWDG is running (WWDG_SW in HW mode) */
     WWDG->CFR = 0x1FF;
     WWDG->CR  = 0x7F;
   }
 
+#if defined FLASH_MEM && defined FLASH_HASH
+  if (fnc == 1U) {                                       /* Hash current content before erase */
+    u32 i;
+    flashHash.id     = 0U;
+    flashHash.uid[0] = M32(UID_BASE + 0U);
+    flashHash.uid[1] = M32(UID_BASE + 4U);
+    flashHash.uid[2] = M32(UID_BASE + 8U);
+    flashHash.pages  = flashSize >> 11;                  /* 2K sector size */
+    if (flashHash.pages > FLASH_HASH_PAGES) {
+      flashHash.pages = FLASH_HASH_PAGES;
+    }
+    for (i = 0U; i < flashHash.pages; i++) {
+      flashHash.hash[i] = Crc32(0xFFFFFFFFU, (unsigned char *)(flashBase + (i << 11)), 0x800U) ^ 0xFFFFFFFFU;
+      if ((optr & FLASH_OPTR_IDWG_SW) == 0U) {
+        IWDG->KR = 0xAAAA;                               /* Reload IWDG */
+      }
+      if ((optr & FLASH_OPTR_WWDG_SW) == 0U) {
+        WWDG->CR = 0x7F;                                 /* Reload WWDG */
+      }
+    }
+    flashHash.id     = FLASH_HASH_ID;
+  }
+#endif /* FLASH_MEM && FLASH_HASH */
+
   return (0);
 }
 
@@ -356,6 +709,26 @@ int Init (unsigned long adr, unsigned long clk, unsigned long fnc) {
  */
 
 int UnInit (unsigned long fnc) {
+  int rc = 0;
+
+#if defined FLASH_MEM && defined FLASH_ERASE_DEFERRED
+  rc = EraseComplete();                                  /* Report deferred erase error */
+#endif
+
+#if (defined FLASH_MEM || defined FLASH_OTP) && defined FLASH_CRC
+  if (crcOpen != 0U) {                                   /* Finalize CRC of programmed data */
+    flashCrc.crc ^= 0xFFFFFFFFU;
+    flashCrc.id   = FLASH_CRC_ID;
+    crcOpen       = 0U;
+  }
+#endif
+
+#if defined FLASH_SESSION
+  if (flashSessionKeep == FLASH_SESSION_KEEP) {          /* Host continues the session */
+    flashSessionKeep = 0U;
+    return (rc);
+  }
+#endif
 
   if ((* (u32 *)flashBase) != 0xFFFFFFFFU) {
     FLASH->ACR &= ~(FLASH_ACR_EMPTY);                    /* Set Flash Empty bit */
@@ -373,7 +746,21 @@ int UnInit (unsigned long fnc) {
   __DSB();
 #endif /* FLASH_OPT */
 
-  return (0);
+  return (rc);
+}
+
+
+/*
+ *  Check Algorithm Residency
+ *    Return Value:   CRC-32 of PrgCode
+ *
+ *  Not part of the FlashOS interface. Needs no Init call.
+ */
+
+unsigned long Resident (void) {
+
+  return (Crc32(0xFFFFFFFFU, Image$$PrgCode$$Base,
+                (u32)(Image$$PrgCode$$Limit - Image$$PrgCode$$Base)) ^ 0xFFFFFFFFU);
 }
 
 
@@ -400,19 +787,30 @@ int BlankCheck (unsigned long adr, unsigned long sz, unsigned char pat) {
 #if defined FLASH_MEM
 int EraseChip (void) {
 
+#if defined FLASH_ERASE_DEFERRED
+  if (EraseComplete() != 0) {                            /* Previous page erase failed */
+    return (1);
+  }
+#endif
+
+  while (FLASH->SR & FLASH_SR_CFGBSY) __NOP();           /* Wait until CR may be written (RM0444) */
+
   FLASH->SR  = FLASH_PGERR;                              /* Reset Error Flags */
 
-  FLASH->CR  = (FLASH_CR_MER1 | FLASH_CR_MER2);          /* Bank A/B mass erase enabled */
-  FLASH->CR |=  FLASH_CR_STRT;                           /* Start erase */
+  FLASH->CR  = (FLASH_CR_MER1 | FLASH_CR_MER2 |          /* Bank A/B mass erase enabled */
+                FLASH_CR_STRT                 );         /* Start erase */
   __DSB();
 
   while (FLASH->SR & FLASH_SR_BSY) __NOP();
 
   if (FLASH->SR & FLASH_PGERR) {                         /* Check for Error */
-    FLASH->SR  = FLASH_PGERR;                            /* Reset Error Flags */
-    return (1);                                          /* Failed */
+    return (FlashError(flashBase));                      /* Failed */
   }
 
+#if defined FLASH_STATS
+  StatsErase(flashBase, flashSize);
+#endif
+
   return (0);                                            /* Done */
 }
 #endif /* FLASH_MEM */
@@ -460,8 +858,7 @@ int EraseChip (void) {
   while (FLASH->SR & FLASH_SR_BSY) __NOP();
 
   if (FLASH->SR & FLASH_PGERR) {                         /* Check for Error */
-    FLASH->SR  = FLASH_PGERR;                            /* Reset Error Flags */
-    return (1);                                          /* Failed */
+    return (FlashError(0x1FFF7800U));                    /* Failed */
   }
 
   return (0);                                            /* Done */
@@ -469,6 +866,67 @@ int EraseChip (void) {
 #endif /* FLASH_OPT */
 
 
+/*
+ *  Erase Bank in Flash Memory
+ *    Parameter:      adr:  Address within the Bank
+ *    Return Value:   0 - OK,  1 - Failed
+ *
+ *  Not part of the FlashOS interface. A host which knows the bank topology
+ *  can call it instead of one EraseSector() per page of the bank.
+ *  Devices handled as single bank (see GetFlashBankNum()) erase the complete flash.
+ */
+
+#if defined FLASH_MEM
+int EraseBank (unsigned long adr) {
+  u32 bankAdr, bankSz, cr;
+
+  if ((flashType == 1U) && ((flashBankMode == 1U) || (flashSize == 0x80000))) {
+    /* Dual-Bank Flash configured as Dual-Bank */
+    bankSz  = flashBankSize;
+  }
+  else {
+    /* Single-Bank Flash or Dual-Bank Flash configured as Single-Bank */
+    bankSz  = flashSize;
+  }
+  bankAdr = (GetFlashBankNum(adr) == 1U) ? (flashBase + flashBankSize) : flashBase;
+
+#if defined FLASH_ERASE_DEFERRED
+  if (EraseComplete() != 0) {                            /* Previous page erase failed */
+    return (1);
+  }
+#endif
+
+  while (FLASH->SR & FLASH_SR_CFGBSY) __NOP();           /* Wait until CR may be written (RM0444) */
+
+  FLASH->SR  = FLASH_PGERR;                              /* Reset Error Flags */
+
+  if (bankSz == flashSize) {
+    cr = (FLASH_CR_MER1 | FLASH_CR_MER2);                /* Bank A/B mass erase enabled */
+  }
+  else if (bankAdr == flashBase) {
+    cr = FLASH_CR_MER1;                                  /* Bank A mass erase enabled */
+  }
+  else {
+    cr = FLASH_CR_MER2;                                  /* Bank B mass erase enabled */
+  }
+  FLASH->CR  = (cr | FLASH_CR_STRT);                     /* Start erase */
+  __DSB();
+
+  while (FLASH->SR & FLASH_SR_BSY) __NOP();
+
+  if (FLASH->SR & FLASH_PGERR) {                         /* Check for Error */
+    return (FlashError(bankAdr));                        /* Failed */
+  }
+
+#if defined FLASH_STATS
+  StatsErase(bankAdr, bankSz);
+#endif
+
+  return (0);                                            /* Done */
+}
+#endif /* FLASH_MEM */
+
+
 /*
  *  Erase Sector in Flash Memory
  *    Parameter:      adr:  Sector Address
@@ -482,21 +940,37 @@ int EraseSector (unsigned long adr) {
   b = GetFlashBankNum(adr);                              /* Get Bank Number 0..1  */
   p = GetFlashPageNum(adr);                              /* Get Page Number 0..x */
 
+#if defined FLASH_ERASE_DEFERRED
+  if (EraseComplete() != 0) {                            /* Previous page erase failed */
+    return (1);
+  }
+#endif
+
+  while (FLASH->SR & FLASH_SR_CFGBSY) __NOP();           /* Wait until CR may be written (RM0444) */
+
   FLASH->SR  = FLASH_PGERR;                              /* Reset Error Flags */
 
-  FLASH->CR  = (FLASH_CR_PER |                           /* Page Erase Enabled */
-                (p <<  3)    |                           /* page Number. 0 to x for each bank */
-                (b << 13)     );
-  FLASH->CR |=  FLASH_CR_STRT;                           /* Start Erase */
+  FLASH->CR  = (FLASH_CR_PER                                 |   /* Page Erase Enabled */
+                ((p << FLASH_CR_PNB_POS) & FLASH_CR_PNB_MSK) |   /* page Number. 0 to x for each bank */
+                ((b != 0U) ? FLASH_CR_BKER : 0U)             |   /* bank Number */
+                FLASH_CR_STRT                                );  /* Start Erase */
   __DSB();
 
+#if defined FLASH_ERASE_DEFERRED
+  eraseAdr     = adr;                                    /* Completion is checked by the next call */
+  erasePending = 1U;
+#else
   while (FLASH->SR & FLASH_SR_BSY) __NOP();
 
   if (FLASH->SR & FLASH_PGERR) {                         /* Check for Error */
-    FLASH->SR  = FLASH_PGERR;                            /* Reset Error Flags */
-    return (1);                                          /* Failed */
+    return (FlashError(adr));                            /* Failed */
   }
 
+#if defined FLASH_STATS
+  StatsInc(&GetPageStats(adr)->erase);
+#endif
+#endif /* FLASH_ERASE_DEFERRED */
+
   return (0);                                            /* Done */
 }
 #endif /* FLASH_MEM */
@@ -512,46 +986,359 @@ int EraseSector (unsigned long adr) {
 #endif /* FLASH_OPT || defined FLASH_OTP */
 
 
+/*
+ *  Add programmed Data to CRC
+ *    Parameter:      adr:  Start Address
+ *                    n:    Number of bytes
+ */
+
+#if (defined FLASH_MEM || defined FLASH_OTP) && defined FLASH_CRC
+static void CrcData (u32 adr, u32 n) {
+
+  if ((crcOpen == 0U) || (n == 0U)) {                   /* No Init(2) */
+    return;
+  }
+
+  flashCrc.crc  = Crc32(flashCrc.crc, (unsigned char *)adr, n);  /* Read back programmed data */
+  flashCrc.cnt += n;
+
+  if (adr < flashCrc.start) {
+    flashCrc.start = adr;
+  }
+  if ((adr + n) > flashCrc.end) {
+    flashCrc.end = adr + n;
+  }
+}
+#endif /* (FLASH_MEM || FLASH_OTP) && FLASH_CRC */
+
+
+/*
+ *  Compare Flash Content with Data
+ *    Parameter:      adr:  Start Address
+ *                    buf:  Data
+ *                    n:    Number of bytes
+ *    Return Value:   0 - OK, Address of first differing byte
+ */
+
+#if defined FLASH_MEM || defined FLASH_OTP
+static u32 CompareData (u32 adr, unsigned char *buf, u32 n) {
+  u32 i;
+
+  for (i = 0U; i < n; i++) {
+    if (*((unsigned char *)(adr + i)) != buf[i]) {       /* Find differing byte */
+      return (adr + i);
+    }
+  }
+
+  return (0U);
+}
+#endif /* FLASH_MEM || FLASH_OTP */
+
+
+/*
+ *  Pre-scan OTP Area before programming
+ *    Parameter:      adr:  Start Address (Double Word aligned)
+ *                    sz:   Size (in bytes, as requested)
+ *                    buf:  Data
+ *    Return Value:   0 - OK,  1 - Failed
+ *
+ *  OTP Double Words can be written only once. Blank Double Words are
+ *  programmed, Double Words already holding the requested bytes are left
+ *  alone, so a provisioning step can be repeated. A written Double Word
+ *  with any requested byte different (also the erased value) fails before
+ *  anything is programmed; flashErrAdr holds the address of that byte.
+ *  Bytes beyond sz are not compared.
+ */
+
+#if defined FLASH_OTP
+static int OtpPrescan (u32 adr, u32 sz, unsigned char *buf) {
+  u32 err, n;
+
+  for (; sz != 0U; sz -= n, adr += 8U, buf += 8U) {
+    n = (sz < 8U) ? sz : 8U;                             /* Requested bytes of Double Word */
+    if ((M32(adr) & M32(adr + 4)) == 0xFFFFFFFFU) {
+      continue;                                          /* Not yet written */
+    }
+    err = CompareData(adr, buf, n);
+    if (err != 0U) {                                     /* Written with different data */
+      flashErrAdr = err;
+      flashErrSR  = 0U;
+      return (1);                                        /* Failed */
+    }
+  }
+
+  return (0);                                            /* Done */
+}
+#endif /* FLASH_OTP */
+
+
+/*
+ *  Program one Double Word (FLASH_CR_PG set by the caller, reset on failure)
+ *    Parameter:      adr:  Double Word Address
+ *                    w:    Double Word Data
+ *                    n:    Number of requested bytes (verified)
+ *    Return Value:   0 - OK,  1 - Failed
+ */
+
+#if defined FLASH_MEM || defined FLASH_OTP
+static int ProgramDoubleWord (u32 adr, u32 *w, u32 n) {
+#if defined FLASH_PROG_VERIFY
+  u32 err;
+#endif
+#if defined FLASH_MEM && defined FLASH_STATS
+  PAGE_STATS *ps = GetPageStats(adr);
+#endif
+
+#if defined FLASH_OTP
+  if (((w[0] & w[1]) != 0xFFFFFFFFU) &&                  /* Erased value need not be programmed */
+      ((M32(adr) & M32(adr + 4)) == 0xFFFFFFFFU)) {      /* Written OTP holds requested value */
+#elif defined FLASH_SKIP_ERASED
+  if ((w[0] & w[1]) != 0xFFFFFFFFU) {                    /* Erased value need not be programmed */
+#else
+  {
+#endif
+    M32(adr    ) = w[0];                                 /* Program the first word of the Double Word */
+    M32(adr + 4) = w[1];                                 /* Program the second word of the Double Word */
+    __DSB();
+
+    while (FLASH->SR & FLASH_SR_BSY) __NOP();
+
+    if (FLASH->SR & FLASH_PGERR) {                       /* Check for Error */
+      FLASH->CR = 0U;
+      return (FlashError(adr));                          /* Failed */
+    }
+
+#if defined FLASH_MEM && defined FLASH_STATS
+    StatsInc(&ps->prog);
+#endif
+  }
+#if defined FLASH_MEM && defined FLASH_STATS && defined FLASH_SKIP_ERASED
+  else {
+    StatsInc(&ps->skip);
+  }
+#endif
+
+#if defined FLASH_PROG_VERIFY
+  err = CompareData(adr, (unsigned char *)w, n);         /* Read back, skipped Double Words too */
+  if (err != 0U) {                                       /* Stop at first mismatch */
+    FLASH->CR   = 0U;
+    flashErrAdr = err;
+    flashErrSR  = 0U;
+    return (1);                                          /* Failed */
+  }
+#endif
+
+  return (0);                                            /* Done */
+}
+#endif /* FLASH_MEM || FLASH_OTP */
+
+
 /*
  *  Program Page in Flash Memory
  *    Parameter:      adr:  Page Start Address
  *                    sz:   Page Size
  *                    buf:  Page Data
  *    Return Value:   0 - OK,  1 - Failed
+ *
+ *  A last partial Double Word is padded with the erased value.
  */
 
 #if defined FLASH_MEM || defined FLASH_OTP
 int ProgramPage (unsigned long adr, unsigned long sz, unsigned char *buf) {
+  u32 w[2], i, n;
+  unsigned char *d = (unsigned char *)w;
+
+#if defined FLASH_MEM && defined FLASH_ERASE_DEFERRED
+  if (EraseComplete() != 0) {                            /* Previous page erase failed */
+    return (1);
+  }
+#endif
+
+#if defined FLASH_OTP
+  if (OtpPrescan(adr, sz, buf) != 0) {                   /* Reject conflicts before any write */
+    return (1);
+  }
+#endif
 
-  sz = (sz + 7) & ~7;                                    /* Adjust size for two words */
+  while (FLASH->SR & FLASH_SR_CFGBSY) __NOP();           /* Wait until CR may be written (RM0444) */
 
   FLASH->SR  = FLASH_PGERR;                              /* Reset Error Flags */
 
   FLASH->CR = FLASH_CR_PG;                               /* Programming Enabled */
 
   while (sz) {
-    M32(adr    ) = *((u32 *)(buf + 0));                  /* Program the first word of the Double Word */
-    M32(adr + 4) = *((u32 *)(buf + 4));                  /* Program the second word of the Double Word */
-    __DSB();
-
-    while (FLASH->SR & FLASH_SR_BSY) __NOP();
+    n = (sz < 8U) ? sz : 8U;                             /* Requested bytes of Double Word */
+    w[0] = *((u32 *)(buf + 0));
+    w[1] = *((u32 *)(buf + 4));
+    for (i = n; i < 8U; i++) {
+      d[i] = 0xFFU;                                      /* Pad with erased value */
+    }
 
-    if (FLASH->SR & FLASH_PGERR) {                       /* Check for Error */
-      FLASH->SR  = FLASH_PGERR;                          /* Reset Error Flags */
+    if (ProgramDoubleWord(adr, w, n) != 0) {
       return (1);                                        /* Failed */
     }
 
+#if defined FLASH_CRC
+    CrcData(adr, n);
+#endif
+
     adr += 8;                                            /* Go to next DoubleWord */
     buf += 8;
-    sz  -= 8;
+    sz  -= n;
   }
 
-  FLASH->CR &= ~(FLASH_CR_PG) ;                          /* Reset CR */
+  FLASH->CR  = 0U;                                       /* Reset CR (only PG was set) */
 
   return (0);
 }
 #endif /* FLASH_MEM || FLASH_OTP */
 
+
+/*
+ *  Program scattered Fragments in Flash Memory
+ *    Parameter:      num:  Number of Fragment Descriptors
+ *                    dsc:  Fragment Descriptors (address, length, offset in buf)
+ *                    sz:   Size of buf (in bytes)
+ *                    buf:  Fragment Data
+ *    Return Value:   0 - OK, Failed Address (0xFFFFFFFF - invalid Parameter)
+ *
+ *  Not part of the FlashOS interface. Programs all fragments with one call.
+ *  The descriptors are sorted by address in place (insertion sort, meant for
+ *  short lists); empty, overlapping or out of buf fragments are rejected.
+ *  The fragments are then programmed in one pass: each Double Word is
+ *  assembled once from the fragments covering it, bytes not covered keep
+ *  the flash content (erased value on a blank Double Word). A Double Word
+ *  already programmed with different data fails. Not available for OTP,
+ *  where conflicts have to be rejected before anything is programmed.
+ */
+
+#if defined FLASH_MEM
+typedef struct {
+  u32 adr;                       /* Flash address */
+  u32 len;                       /* Length in bytes */
+  u32 ofs;                       /* Offset of data in buf */
+} FRAGMENT;
+
+unsigned long ProgramScatter (unsigned long num, FRAGMENT *dsc, unsigned long sz, unsigned char *buf) {
+  FRAGMENT t;
+  u32 f, g, i, e, dw;
+  u32 w[2];
+  unsigned char *d = (unsigned char *)w;
+
+  for (f = 1U; f < num; f++) {                           /* Sort Fragments by address */
+    t = dsc[f];
+    for (g = f; (g > 0U) && (dsc[g - 1U].adr > t.adr); g--) {
+      dsc[g] = dsc[g - 1U];
+    }
+    dsc[g] = t;
+  }
+
+  for (f = 0U; f < num; f++) {
+    if ((dsc[f].len == 0U) || (dsc[f].len > sz) || (dsc[f].ofs > (sz - dsc[f].len))) {
+      return (0xFFFFFFFFU);                              /* Empty or outside of buf */
+    }
+    if (((f + 1U) < num) && ((dsc[f].adr + dsc[f].len) > dsc[f + 1U].adr)) {
+      return (0xFFFFFFFFU);                              /* Overlapping Fragments */
+    }
+  }
+
+#if defined FLASH_MEM && defined FLASH_ERASE_DEFERRED
+  if (EraseComplete() != 0) {                            /* Previous page erase failed */
+    return (flashErrAdr);
+  }
+#endif
+
+  while (FLASH->SR & FLASH_SR_CFGBSY) __NOP();           /* Wait until CR may be written (RM0444) */
+
+  FLASH->SR  = FLASH_PGERR;                              /* Reset Error Flags */
+
+  FLASH->CR = FLASH_CR_PG;                               /* Programming Enabled */
+
+  dw = 0U;
+  f  = 0U;
+  while (f < num) {
+    if (dw < (dsc[f].adr & ~7U)) {                       /* Go to Double Word of next Fragment */
+      dw = dsc[f].adr & ~7U;
+    }
+
+    w[0] = M32(dw);                                      /* Keep bytes not covered */
+    w[1] = M32(dw + 4);
+    for (g = f; (g < num) && (dsc[g].adr < (dw + 8U)); g++) {   /* Assemble Double Word */
+      i = (dsc[g].adr > dw) ? dsc[g].adr : dw;
+      e = dsc[g].adr + dsc[g].len;
+      if (e > (dw + 8U)) {
+        e = dw + 8U;
+      }
+      for (; i < e; i++) {
+        d[i - dw] = buf[dsc[g].ofs + (i - dsc[g].adr)];
+      }
+    }
+
+    if ((M32(dw) & M32(dw + 4)) != 0xFFFFFFFFU) {        /* Already programmed */
+      i = CompareData(dw, d, 8U);
+      if (i != 0U) {                                     /* Written with different data */
+        FLASH->CR   = 0U;
+        flashErrAdr = i;
+        flashErrSR  = 0U;
+        return (i);                                      /* Failed */
+      }
+    }
+    else if (ProgramDoubleWord(dw, w, 8U) != 0) {
+      return (flashErrAdr);                              /* Failed */
+    }
+
+    while ((f < num) && ((dsc[f].adr + dsc[f].len) <= (dw + 8U))) {   /* Fragment complete */
+#if defined FLASH_CRC
+      CrcData(dsc[f].adr, dsc[f].len);
+#endif
+      f++;
+    }
+    dw += 8U;
+  }
+
+  FLASH->CR  = 0U;                                       /* Reset CR (only PG was set) */
+
+  return (0);                                            /* Done */
+}
+#endif /* FLASH_MEM */
+
+
+/*
+ *  Erase and Program whole Pages in Flash Memory
+ *    Parameter:      adr:  Page Start Address (2K aligned)
+ *                    sz:   Size (in bytes, multiple of 2K)
+ *                    buf:  Page Data
+ *    Return Value:   0 - OK, Failed Address (0xFFFFFFFF - invalid Parameter)
+ *
+ *  Not part of the FlashOS interface. Replaces one EraseSector() and the
+ *  ProgramPage() calls per page by a single call. Every page is erased,
+ *  like BlankCheck() forces an erase, because of ECC.
+ */
+
+#if defined FLASH_MEM
+unsigned long EraseProgram (unsigned long adr, unsigned long sz, unsigned char *buf) {
+  if (((adr | sz) & 0x7FFU) != 0U) {                     /* Only whole 2K pages */
+    return (0xFFFFFFFFU);
+  }
+
+  while (sz) {
+    if (EraseSector(adr) != 0) {
+      return (flashErrAdr);                              /* Failed */
+    }
+
+    if (ProgramPage(adr, 0x800U, buf) != 0) {
+      return (flashErrAdr);                              /* Failed */
+    }
+
+    adr += 0x800U;                                       /* Go to next Page */
+    buf += 0x800U;
+    sz  -= 0x800U;
+  }
+
+  return (0);                                            /* Done */
+}
+#endif /* FLASH_MEM */
+
 #ifdef FLASH_OPT
 int ProgramPage (unsigned long adr, unsigned long sz, unsigned char *buf) {
 #if defined STM32G0x0
@@ -620,8 +1407,7 @@ int ProgramPage (unsigned long adr, unsigned long sz, unsigned char *buf) {
   while (FLASH->SR & FLASH_SR_BSY) __NOP();
 
   if (FLASH->SR & FLASH_PGERR) {                        /* Check for Error */
-    FLASH->SR |= FLASH_PGERR;                           /* Reset Error Flags */
-    return (1);                                         /* Failed */
+    return (FlashError(adr));                           /* Failed */
   }
 
   return (0);                                           /* Done */